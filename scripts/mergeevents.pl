@@ -0,0 +1,207 @@
+#!/usr/bin/perl
+######################################################################
+# Name: mergeevents.pl
+# Merges the EventDataSet XML files written by mbarivision for
+# consecutive chunks of one clip into a single EventDataSet.
+#
+# Each chunk owns a range of frames and may start a number of frames
+# earlier to warm up the background cache. The frames before a chunk's
+# own range overlap the end of the previous chunk; events of the two
+# chunks are matched by their bounding boxes in those frames so that
+# tracks crossing the seam keep a single ObjectID. Event IDs are
+# renumbered in the order the events first appear in the merged output.
+#
+# Copyright (c) MBARI 2018
+######################################################################
+use strict;
+use Getopt::Long;
+
+my $USAGE = <<EOU;
+USAGE: $0 -o=merged.xml [-t=0.5] first:last:chunk.xml [first:last:chunk.xml ...]
+Options:
+    -o=merged.xml    Output EventDataSet
+    -t=0.5           Minimum mean bounding box overlap (intersection over union)
+                     in the seam frames for two events to be joined
+Each chunk is given with the first and last frame it owns, in frame order.
+EOU
+
+my %OPTIONS;
+my $rc = GetOptions(\%OPTIONS, 'o=s', 't=s');
+die $USAGE unless $rc && $OPTIONS{o} && @ARGV;
+
+my $output = $OPTIONS{o};
+my $threshold = defined $OPTIONS{t} ? $OPTIONS{t} : 0.5;
+
+# returns the value of attribute $name in the start tag $tag
+sub get_attr {
+    my ($tag, $name) = @_;
+    return $1 if $tag =~ /\s$name\s*=\s*"([^"]*)"/;
+    return undef;
+}
+
+# returns the start tag $tag with attribute $name set to $value
+sub set_attr {
+    my ($tag, $name, $value) = @_;
+    return $tag if !defined $value;
+    if ($tag !~ s/(\s$name\s*=\s*")[^"]*(")/$1$value$2/) {
+        $tag =~ s/(\s*\/?>)$/ $name="$value"$1/;
+    }
+    return $tag;
+}
+
+# intersection over union of two bounding boxes [left, bottom, right, top]
+sub iou {
+    my ($a, $b) = @_;
+    my $w = (($a->[2] < $b->[2]) ? $a->[2] : $b->[2]) - (($a->[0] > $b->[0]) ? $a->[0] : $b->[0]) + 1;
+    my $h = (($a->[1] < $b->[1]) ? $a->[1] : $b->[1]) - (($a->[3] > $b->[3]) ? $a->[3] : $b->[3]) + 1;
+    return 0 if $w <= 0 || $h <= 0;
+    my $areaA = ($a->[2] - $a->[0] + 1) * ($a->[1] - $a->[3] + 1);
+    my $areaB = ($b->[2] - $b->[0] + 1) * ($b->[1] - $b->[3] + 1);
+    return $w * $h / ($areaA + $areaB - $w * $h);
+}
+
+# reads a chunk; returns its header, root start tag and frames keyed by frame number
+sub read_chunk {
+    my ($file) = @_;
+    open(my $fh, '<', $file) or die "Cannot open $file: $!\n";
+    local $/;
+    my $xml = <$fh>;
+    close($fh);
+
+    my $chunk = { 'frames' => {}, 'boxes' => {} };
+    $xml =~ /<EventDataSet\b[^>]*>/ or die "$file is not an EventDataSet\n";
+    $chunk->{'root'} = $&;
+    if ($xml =~ /(\s*)<FrameEventSet\b/) {
+        $chunk->{'header'} = $`;
+    }
+    else {
+        ($chunk->{'header'} = $xml) =~ s/\s*<\/EventDataSet>\s*$//;
+    }
+
+    while ($xml =~ /(\s*)(<FrameEventSet\b[^>]*?)(\/>|>(.*?)(\s*)<\/FrameEventSet>)/gs) {
+        my ($indent, $start, $end, $body, $close) = ($1, $2, $3, $4, $5);
+        my $num = get_attr($start, 'FrameNumber');
+        my $frame = { 'indent' => $indent, 'start' => $start,
+                      'timecode' => get_attr($start, 'TimeCode'),
+                      'close' => defined $close ? $close : '', 'events' => [] };
+        if (defined $body) {
+            while ($body =~ /(\s*)(<EventObject\b[^>]*?)(\/>|>.*?<\/EventObject>)/gs) {
+                my ($eindent, $estart, $erest) = ($1, $2, $3);
+                my $id = get_attr($estart, 'ObjectID');
+                my $event = { 'indent' => $eindent, 'start' => $estart, 'rest' => $erest, 'id' => $id };
+                if ($erest =~ /<BoundingBox\b([^>]*)>/) {
+                    my $bb = $1;
+                    $chunk->{'boxes'}{$id}{$num} = [ get_attr($bb, 'LowerLeftX'), get_attr($bb, 'LowerLeftY'),
+                                                     get_attr($bb, 'UpperRightX'), get_attr($bb, 'UpperRightY') ];
+                }
+                push @{$frame->{'events'}}, $event;
+            }
+        }
+        $chunk->{'frames'}{$num} = $frame;
+    }
+    return $chunk;
+}
+
+# read the chunks
+my @chunks;
+foreach my $arg (@ARGV) {
+    my ($first, $last, $file) = ($arg =~ /^(-?\d+):(-?\d+):(.+)$/) or die $USAGE;
+    my $chunk = read_chunk($file);
+    $chunk->{'first'} = $first;
+    $chunk->{'last'} = $last;
+    push @chunks, $chunk;
+}
+
+my $next_id = 1;
+my %start_frame;    # first frame of each merged event
+my %start_timecode; # timecode of the first frame of each merged event
+my $prev_map = {};  # chunk-local to merged event IDs of the previous chunk
+my $body = '';
+my $joined = 0;
+
+for (my $c = 0; $c <= $#chunks; $c++) {
+    my $chunk = $chunks[$c];
+    my %map;
+
+    # join the events that the previous chunk also saw in the seam frames
+    if ($c > 0) {
+        my $prev = $chunks[$c - 1];
+        my @pairs;
+        foreach my $id (keys %{$chunk->{'boxes'}}) {
+            my $boxes = $chunk->{'boxes'}{$id};
+            my @seam = grep { $_ < $chunk->{'first'} } keys %$boxes;
+            next unless @seam;
+            foreach my $pid (keys %{$prev->{'boxes'}}) {
+                next unless defined $prev_map->{$pid};
+                my $pboxes = $prev->{'boxes'}{$pid};
+                my ($sum, $n) = (0, 0);
+                foreach my $f (@seam) {
+                    next unless defined $pboxes->{$f};
+                    $sum += iou($boxes->{$f}, $pboxes->{$f});
+                    $n++;
+                }
+                push @pairs, [ $sum / $n, $id, $prev_map->{$pid} ] if $n > 0 && $sum / $n >= $threshold;
+            }
+        }
+        my %used;
+        foreach my $pair (sort { $b->[0] <=> $a->[0] || $a->[1] <=> $b->[1] } @pairs) {
+            next if defined $map{$pair->[1]} || $used{$pair->[2]};
+            $map{$pair->[1]} = $pair->[2];
+            $used{$pair->[2]} = 1;
+            $joined++;
+        }
+    }
+
+    # the chunk's own frames go to the output; new events are numbered as they appear
+    foreach my $num (sort { $a <=> $b } keys %{$chunk->{'frames'}}) {
+        next if $num < $chunk->{'first'} || $num > $chunk->{'last'};
+        my $frame = $chunk->{'frames'}{$num};
+        $body .= $frame->{'indent'} . $frame->{'start'};
+        if (!@{$frame->{'events'}}) {
+            $body .= '/>';
+            next;
+        }
+        $body .= '>';
+        foreach my $event (@{$frame->{'events'}}) {
+            my $id = $event->{'id'};
+            if (!defined $map{$id}) {
+                $map{$id} = $next_id++;
+                my $start = get_attr($event->{'start'}, 'StartFrameNumber');
+                # an event first seen while warming up the cache starts here in the merged output
+                if (!defined $start || $start < $chunk->{'first'}) {
+                    $start_frame{$map{$id}} = $num;
+                    $start_timecode{$map{$id}} = $frame->{'timecode'};
+                }
+                else {
+                    $start_frame{$map{$id}} = $start;
+                    $start_timecode{$map{$id}} = get_attr($event->{'start'}, 'StartTimecode');
+                }
+            }
+            my $gid = $map{$id};
+            my $start = set_attr($event->{'start'}, 'ObjectID', $gid);
+            $start = set_attr($start, 'StartFrameNumber', $start_frame{$gid});
+            $start = set_attr($start, 'StartTimecode', $start_timecode{$gid});
+            $body .= $event->{'indent'} . $start . $event->{'rest'};
+        }
+        $body .= $frame->{'close'} . '</FrameEventSet>';
+    }
+    $prev_map = \%map;
+}
+
+# the header of the first chunk describes the whole clip once its end is updated
+my $root = $chunks[0]->{'root'};
+my $last_root = $chunks[$#chunks]->{'root'};
+$root = set_attr($root, 'StartFrame', $chunks[0]->{'first'});
+$root = set_attr($root, 'EndFrame', get_attr($last_root, 'EndFrame'));
+$root = set_attr($root, 'EndTimecode', get_attr($last_root, 'EndTimecode'));
+my $header = $chunks[0]->{'header'};
+$header =~ s/<EventDataSet\b[^>]*>/$root/;
+
+open(my $out, '>', $output) or die "Cannot write $output: $!\n";
+print $out $header . $body . "\n</EventDataSet>\n";
+close($out);
+
+print "Merged " . scalar(@chunks) . " chunks into $output: " . ($next_id - 1) .
+      " events, $joined joined across chunk boundaries\n";
+exit 0;
+######################################################################
@@ -14,6 +14,9 @@ using namespace std;
 #define NUM_BINS 9
 #define PI 3.14159265f
 
+// only read after construction, so all feature stacks share it
+HoG Features::hog;
+
 HoG::HoG() {
 	bins = NUM_BINS;
 	binsize = (PI * 80.0f)/float(bins);;
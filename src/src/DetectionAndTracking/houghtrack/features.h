@@ -10,6 +10,11 @@
 
 #include "utilities.h"
 
+// pixels beyond a region the filters read; the median, Sobel and HoG
+// kernels together reach 4 pixels, so channels computed with this much
+// padding equal those of the whole frame inside the region
+#define FEATURE_BORDER 8
+
 class HoG {
 public:
 	HoG();
@@ -61,6 +66,10 @@ inline void HoG::binning(float v, float w, double* desc, int maxb) {
 	desc[bin2] += delta*w;
 }
 
+// The channels are cv::Mat headers, so copies of a Features share the
+// channel data; one frame's channels can be computed once and handed to
+// every tracker that only reads them. The channels may cover a region of
+// the frame only; they are then addressed relative to getOrigin().
 class Features
 {
 public:
@@ -79,18 +88,54 @@ public:
 	inline void clear()
 	{
 		m_channels.clear();
+		m_rect = cv::Rect();
+		m_origin = cv::Point();
 	}
 
-	inline void setImage(cv::Mat& img)
+	inline void setImage(const cv::Mat& img)
+	{
+		setImage(img, cv::Rect(0, 0, img.cols, img.rows));
+	};
+
+	// computes the channels of the pixels of img in roi only, from roi padded by FEATURE_BORDER
+	inline void setImage(const cv::Mat& img, const cv::Rect& roi)
 	{
+		const cv::Rect frame(0, 0, img.cols, img.rows);
 		m_channels.clear();
-	    m_channels.resize(m_numChannels);
-		m_cols = img.cols;
-		m_rows = img.rows;
-	    extractFeatureChannels(img, m_channels);
-    };
+		m_rect = roi & frame;
+		if (m_rect.width <= 0 || m_rect.height <= 0) {
+			clear();
+			m_cols = m_rows = 0;
+			return;
+		}
+		const cv::Rect padded = cv::Rect(m_rect.x - FEATURE_BORDER, m_rect.y - FEATURE_BORDER,
+		                                 m_rect.width + 2 * FEATURE_BORDER, m_rect.height + 2 * FEATURE_BORDER) & frame;
+		m_origin = padded.tl();
+		m_channels.resize(m_numChannels);
+		m_cols = padded.width;
+		m_rows = padded.height;
+		extractFeatureChannels(img(padded), m_channels);
+	};
+
+	// the top left corner of the channels in frame coordinates
+	inline cv::Point getOrigin() const
+	{
+		return m_origin;
+	};
+
+	// the region of the frame the channels are exact for
+	inline cv::Rect getRect() const
+	{
+		return m_rect;
+	};
+
+	// true if the channels are exact for all of r
+	inline bool covers(const cv::Rect& r) const
+	{
+		return (r & m_rect) == r;
+	};
 
-	inline const cv::Mat getChannel(unsigned int idx) const
+	inline const cv::Mat& getChannel(unsigned int idx) const
 	{
     	return m_channels.at(idx);
     };
@@ -109,10 +154,12 @@ private:
 	unsigned int m_numChannels;
 	unsigned int m_cols;
 	unsigned int m_rows;
+	cv::Rect m_rect;
+	cv::Point m_origin;
 	std::vector<cv::Mat> m_channels;
-	HoG hog;
+	static HoG hog;
 
-	inline void extractFeatureChannels(const cv::Mat &img, std::vector<cv::Mat >& vImg)
+	static inline void extractFeatureChannels(const cv::Mat &img, std::vector<cv::Mat >& vImg)
 	{
 	    // 16 feature channels
 	    // 7+9 channels: L, a, b, |I_x|, |I_y|, |I_xx|, |I_yy|, HOGlike features with 9 bins (weighted orientations 5x5 neighborhood)
@@ -5,12 +5,113 @@
 
 #include "fern.h"
 
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 //int Node::MapStep = MAP_STEP;
 //int Node::MapSize = MAP_SIZE;
 
 using namespace std;
 using namespace cv;
 
+namespace {
+// the number of points at stepSize intervals in length
+inline int numSteps(int length, int stepSize)
+{
+	return length > 0 ? (length + stepSize - 1) / stepSize : 0;
+}
+
+// marks the points with votes in counts, from Fern::backProjectCounts(), that are not GC_FGD yet; returns their votes
+int markCounts(Mat& projected, const Rect& ROI, int stepSize, const vector<unsigned char>& counts)
+{
+	const int nx = numSteps(ROI.width, stepSize);
+	const int ny = numSteps(ROI.height, stepSize);
+	int cnt = 0;
+
+	for(int j = 0, y = ROI.y; j < ny; j++, y += stepSize)
+	{
+		for(int i = 0, x = ROI.x; i < nx; i++, x += stepSize)
+		{
+			const unsigned char c = counts[j * nx + i];
+			if(c > 0 && projected.at<unsigned char>( y, x ) != GC_FGD)
+			{
+				cnt += c;
+				projected.at<unsigned char>( y, x ) = GC_FGD;
+			}
+		}
+	}
+
+	return cnt;
+}
+
+// the ferns [begin, end) one thread evaluates or back projects
+struct FernJob
+{
+	const vector< Fern >* ferns;
+	unsigned int begin, end;
+	const Features* ft;
+	Rect ROI;
+	int stepSize;
+
+	// evaluate: the votes of the ferns, for the points of votesRect of the result
+	Rect votesRect;
+	Mat votes;
+
+	// backProject: the votes of each fern within radius of center
+	const Mat* projected;
+	Point center;
+	float radius;
+	vector< vector<unsigned char> >* counts;
+};
+
+void *evaluateFerns(void *arg)
+{
+	FernJob *job = (FernJob *) arg;
+	for(unsigned int f = job->begin; f < job->end; f++)
+		job->ferns->at(f).evaluate(*job->ft, job->ROI, job->votes, job->votesRect.tl(), job->stepSize, 0.5f);
+	return NULL;
+}
+
+void *countFerns(void *arg)
+{
+	FernJob *job = (FernJob *) arg;
+	for(unsigned int f = job->begin; f < job->end; f++)
+		job->ferns->at(f).backProjectCounts(*job->ft, *job->projected, job->ROI, job->center, job->radius, job->stepSize,
+											0.5f, job->counts->at(f));
+	return NULL;
+}
+
+// runs the jobs, the first one on the calling thread
+void runJobs(vector< FernJob >& jobs, void *(*work)(void *))
+{
+	vector< pthread_t > threads(jobs.size() - 1);
+	for(unsigned int t = 0; t < threads.size(); t++)
+		pthread_create(&threads[t], NULL, work, &jobs[t + 1]);
+	work(&jobs[0]);
+	for(unsigned int t = 0; t < threads.size(); t++)
+		pthread_join(threads[t], NULL);
+}
+
+// splits ferns [0, numFerns) into numThreads jobs of consecutive ferns
+vector< FernJob > splitFerns(const vector< Fern >& ferns, unsigned int numFerns, unsigned int numThreads,
+							 const Features& ft, const Rect& ROI, int stepSize)
+{
+	vector< FernJob > jobs(min(numThreads, numFerns));
+	for(unsigned int t = 0; t < jobs.size(); t++)
+	{
+		jobs[t].ferns = &ferns;
+		jobs[t].begin = t * numFerns / jobs.size();
+		jobs[t].end = (t + 1) * numFerns / jobs.size();
+		jobs[t].ft = &ft;
+		jobs[t].ROI = ROI;
+		jobs[t].stepSize = stepSize;
+	}
+	return jobs;
+}
+}
+
 bool sortVotesDesc (const pair<CvPoint, float>& A, const pair<CvPoint, float>& B)
 {
 	return (A.second > B.second);
@@ -21,50 +122,66 @@ bool sortFernsDesc (const Fern& A, const Fern& B)
 	return A.getTableSize() > B.getTableSize();
 }
 
-Fern::Fern( const Size& baseSize, unsigned int numTests, unsigned int numChannels )
-: m_baseSize(baseSize), m_numTests(numTests), numPos(1), numNeg(1)
+Fern::Fern( const Size& baseSize, unsigned int numTests, unsigned int numChannels, unsigned int& seed )
+: m_baseSize(baseSize), m_numTests(numTests), numPos(1), numNeg(1), m_scale(1.0f)
 {
  	for(unsigned int t = 0; t < numTests; t++)
-		m_tests.push_back( RandomTest(baseSize, numChannels) );
-
-	m_nodeTable.clear();
+		m_tests.push_back( RandomTest(baseSize, numChannels, seed) );
 }
 
 Fern::~Fern()
 {
 	m_tests.clear();
-	m_nodeTable.clear();
+	m_nodeIndex.clear();
+	m_nodes.clear();
+}
+
+size_t Fern::getBytes() const
+{
+	size_t bytes = m_tests.capacity() * sizeof(RandomTest) + m_nodeIndex.capacity() * sizeof(unsigned short) +
+				   m_nodes.capacity() * sizeof(Node);
+	for(unsigned int n = 0; n < m_nodes.size(); n++)
+		bytes += m_nodes[n].getBytes();
+	return bytes;
+}
+
+void Fern::evaluate(const Features& ft, const Rect& ROI, Mat& result, int stepSize, float threshold) const
+{
+	evaluate(ft, ROI, result, Point(0, 0), stepSize, threshold);
 }
 
-void Fern::evaluate(Features& ft, const Rect& ROI, Mat& result, int stepSize, float threshold) const
+void Fern::evaluate(const Features& ft, const Rect& ROI, Mat& result, const Point& origin, int stepSize, float threshold) const
 {
-	map< unsigned int, Node >::const_iterator it;
-	map< unsigned int, Node >::const_iterator end = m_nodeTable.end();
+	const Rect points(ROI.x, ROI.y, ROI.width - m_baseSize.width, ROI.height - m_baseSize.height);
+	const int nx = numSteps(points.width, stepSize);
+	const int ny = numSteps(points.height, stepSize);
+	if(nx == 0 || ny == 0)
+		return;
+
+	vector< CompiledTest > tests;
+	vector< unsigned short > idx;
+	compile(ft, tests);
+	calcIndices(tests, points, stepSize, idx);
 
-	for(int x = ROI.x; x < (ROI.x + ROI.width - m_baseSize.width); x+=stepSize)
+	for(int i = 0, x = points.x; i < nx; i++, x += stepSize)
 	{
-		for(int y = ROI.y; y < (ROI.y + ROI.height - m_baseSize.height); y+=stepSize)
+		for(int j = 0, y = points.y; j < ny; j++, y += stepSize)
 		{
-			it = m_nodeTable.find( calcIndex(ft, Point(x,y)) );
+			const Node* node = findNode( idx[j * nx + i] );
 
-			if(it != end)
+			if(node != NULL)
 			{
-				const Node& node = (*it).second;
-
-				if(node.probPos > threshold)
+				if(node->probPos > threshold)
 				{
+					const Node::VoteList& votes = node->getVotes();
 
-					vector< pair< Point, float > > votes = node.getVotes();
-
-					for(unsigned int v = 0; v < votes.size(); v++)
+					for(int v = 0; v < votes.size; v++)
 					{
-						Point pos = Point(x + votes.at(v).first.x, y + votes.at(v).first.y);
+						Point pos = Point(x + votes.offset[v].x - origin.x, y + votes.offset[v].y - origin.y);
 
 						if((pos.x >= 0) && (pos.y >= 0) && (pos.x < result.cols) && (pos.y < result.rows))
-							result.at<float>( pos.y, pos.x ) += votes.at(v).second;
+							result.at<float>( pos.y, pos.x ) += votes.weight[v];
 					}
-
-					votes.clear();
 				}
 
 			}
@@ -72,99 +189,222 @@ void Fern::evaluate(Features& ft, const Rect& ROI, Mat& result, int stepSize, fl
 	}
 }
 
-int Fern::backProject(Features& ft, Mat& projected, const Rect& ROI, Point& center, float radius, int stepSize, float threshold) const
+int Fern::backProject(const Features& ft, Mat& projected, const Rect& ROI, Point& center, float radius, int stepSize, float threshold) const
+{
+	vector< unsigned char > counts;
+	backProjectCounts(ft, projected, ROI, center, radius, stepSize, threshold, counts);
+	return markCounts(projected, ROI, stepSize, counts);
+}
+
+void Fern::backProjectCounts(const Features& ft, const Mat& projected, const Rect& ROI, const Point& center, float radius, int stepSize, float threshold, vector<unsigned char>& counts) const
 {
-	map< unsigned int, Node >::const_iterator it;
-	map< unsigned int, Node >::const_iterator end = m_nodeTable.end();
 	float max_dist_sq = radius * radius;
+	const int nx = numSteps(ROI.width, stepSize);
+	const int ny = numSteps(ROI.height, stepSize);
+	counts.assign(nx * ny, 0);
+	if(counts.empty())
+		return;
 
-	int cnt = 0;
+	vector< CompiledTest > tests;
+	vector< unsigned short > idx;
+	compile(ft, tests);
+	calcIndices(tests, ROI, stepSize, idx);
 
-	for(int x = ROI.x; x < (ROI.x + ROI.width); x+=stepSize)
+	for(int i = 0, x = ROI.x; i < nx; i++, x += stepSize)
 	{
-		for(int y = ROI.y; y < (ROI.y + ROI.height); y+=stepSize)
+		for(int j = 0, y = ROI.y; j < ny; j++, y += stepSize)
 		{
 			unsigned char prior = projected.at<unsigned char>( y, x );
 			if(prior == GC_FGD)
 				continue;
 
-			it = m_nodeTable.find( calcIndex(ft, Point(x, y)) );
+			const Node* node = findNode( idx[j * nx + i] );
 
-			if(it != end)
+			if(node != NULL)
 			{
-				const Node& node = (*it).second;
-
-				if(node.probPos > threshold)
+				if(node->probPos > threshold)
 				{
-					vector< pair< Point, float > > votes = node.getVotes();
+					const Node::VoteList& votes = node->getVotes();
 
-					for(unsigned int v = 0; v < votes.size(); v++)
+					for(int v = 0; v < votes.size; v++)
 					{
-						Point pos = Point(x + votes.at(v).first.x, y + votes.at(v).first.y);
+						Point pos = Point(x + votes.offset[v].x, y + votes.offset[v].y);
 						float dist_sq = static_cast<float>(pow(pos.x-center.x, 2.0f) + pow(pos.y-center.y, 2.0f));
 
 						if(dist_sq <= max_dist_sq)
-						{
-							cnt++;
-							projected.at<unsigned char>( y, x ) = GC_FGD;
-						}
+							counts[j * nx + i]++;
 					}
-
-					votes.clear();
 				}
 			}
 		}
 	}
+}
 
-	return cnt;
+void Fern::calcIndices(const vector<CompiledTest>& tests, const Rect& ROI, int stepSize, vector<unsigned short>& idx) const
+{
+	const int nx = numSteps(ROI.width, stepSize);
+	const int ny = numSteps(ROI.height, stepSize);
+	idx.assign(nx * ny, 0);
+
+	if(stepSize != 1)
+	{
+		for(int j = 0, y = ROI.y; j < ny; j++, y += stepSize)
+			for(int i = 0, x = ROI.x; i < nx; i++, x += stepSize)
+				idx[j * nx + i] = calcIndex(tests, Point(x, y));
+		return;
+	}
+
+	// a test compares the same two pixels of every patch, so a row of patches compares two rows of pixels
+	for(int j = 0; j < ny; j++)
+	{
+		unsigned short* row = &idx[j * nx];
+		for(unsigned int t = 0; t < m_numTests; t++)
+		{
+			const CompiledTest& test = tests[t];
+			const uchar* a = test.channel + (ROI.y + j) * test.step + ROI.x + test.offA;
+			const uchar* b = test.channel + (ROI.y + j) * test.step + ROI.x + test.offB;
+			int i = 0;
+#ifdef __SSE2__
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i one = _mm_set1_epi8(1);
+			for(; i + 16 <= nx; i += 16)
+			{
+				// 1 where a > b, as unsigned bytes
+				__m128i bit = _mm_min_epu8(_mm_subs_epu8(_mm_loadu_si128((const __m128i*) (a + i)),
+														_mm_loadu_si128((const __m128i*) (b + i))), one);
+				__m128i lo = _mm_loadu_si128((const __m128i*) (row + i));
+				__m128i hi = _mm_loadu_si128((const __m128i*) (row + i + 8));
+				lo = _mm_or_si128(_mm_slli_epi16(lo, 1), _mm_unpacklo_epi8(bit, zero));
+				hi = _mm_or_si128(_mm_slli_epi16(hi, 1), _mm_unpackhi_epi8(bit, zero));
+				_mm_storeu_si128((__m128i*) (row + i), lo);
+				_mm_storeu_si128((__m128i*) (row + i + 8), hi);
+			}
+#endif
+			for(; i < nx; i++)
+				row[i] = (row[i] << 1) | (a[i] > b[i] ? 1 : 0);
+		}
+	}
 }
 
-void Fern::forget(const double& factor)
+void Fern::write(ostream& os) const
 {
-	map< unsigned int, Node >::iterator it = m_nodeTable.begin();
-	while(it != m_nodeTable.end())
+	os.write((const char *) &m_baseSize, sizeof(m_baseSize));
+	os.write((const char *) &m_numTests, sizeof(m_numTests));
+	os.write((const char *) &numPos, sizeof(numPos));
+	os.write((const char *) &numNeg, sizeof(numNeg));
+	os.write((const char *) &m_scale, sizeof(m_scale));
+
+	for(unsigned int t = 0; t < m_tests.size(); t++)
+		m_tests.at(t).write(os);
+
+	unsigned int numNodes = m_nodes.size();
+	os.write((const char *) &numNodes, sizeof(numNodes));
+	for(unsigned int idx = 0; idx < m_nodeIndex.size(); idx++)
 	{
-		(*it++).second.forget(factor);
+		if(m_nodeIndex[idx] == 0)
+			continue;
+		os.write((const char *) &idx, sizeof(idx));
+		m_nodes[m_nodeIndex[idx] - 1].write(os);
 	}
+}
+
+void Fern::read(istream& is)
+{
+	is.read((char *) &m_baseSize, sizeof(m_baseSize));
+	is.read((char *) &m_numTests, sizeof(m_numTests));
+	is.read((char *) &numPos, sizeof(numPos));
+	is.read((char *) &numNeg, sizeof(numNeg));
+	is.read((char *) &m_scale, sizeof(m_scale));
 
+	m_tests.clear();
+	for(unsigned int t = 0; t < m_numTests; t++)
+		m_tests.push_back( RandomTest(is) );
+
+	unsigned int numNodes = 0;
+	is.read((char *) &numNodes, sizeof(numNodes));
+	m_nodeIndex.clear();
+	m_nodes.clear();
+	if(numNodes > 0)
+		m_nodeIndex.assign(1 << m_numTests, 0);
+	m_nodes.reserve(numNodes);
+	for(unsigned int n = 0; n < numNodes; n++)
+	{
+		unsigned int idx = 0;
+		is.read((char *) &idx, sizeof(idx));
+		m_nodes.push_back( Node() );
+		m_nodes.back().read(is);
+		m_nodeIndex[idx] = m_nodes.size();
+	}
 }
 
-void Fern::clear()
+void Fern::forget(const double& factor)
 {
-	map< unsigned int, Node >::iterator it = m_nodeTable.begin();
-	while(it != m_nodeTable.end())
+	// the votes and counts of the nodes are only ever compared to each other, so scaling them all
+	// can wait until the scale gets too small for new votes to be added precisely; the cached vote
+	// lists of the nodes are such ratios too and stay valid
+	m_scale *= factor;
+	if(m_scale < MIN_VOTE_SCALE)
 	{
-		(*it++).second.clear();
+		for(unsigned int n = 0; n < m_nodes.size(); n++)
+			m_nodes[n].rescale(m_scale);
+		m_scale = 1.0f;
 	}
+}
+
+void Fern::clear()
+{
+	// a cleared node learns exactly like a new one, so the nodes are freed
+	vector< unsigned short >().swap(m_nodeIndex);
+	vector< Node >().swap(m_nodes);
 	numPos = 1.0f;
 	numNeg = 1.0f;
+	m_scale = 1.0f;
 }
 
-void Fern::update(Features& ft, const Point& pos, int label, const Point& center)
+void Fern::update(const Features& ft, const Point& pos, int label, const Point& center)
 {
-	unsigned int idx = calcIndex(ft, pos);
-	map< unsigned int, Node >::iterator it = m_nodeTable.find( idx );
+	vector< CompiledTest > tests;
+	compile(ft, tests);
+	learn(calcIndex(tests, pos), label, Point(center.x-pos.x, center.y-pos.y));
+}
 
-	if(it == m_nodeTable.end())
+void Fern::update(const Features& ft, const vector< pair<Point, int> >& samples, const Point& center)
+{
+	vector< CompiledTest > tests;
+	compile(ft, tests);
+	for(unsigned int s = 0; s < samples.size(); s++)
+	{
+		const Point& pos = samples[s].first;
+		learn(calcIndex(tests, pos), samples[s].second, Point(center.x-pos.x, center.y-pos.y));
+	}
+}
+
+void Fern::learn(unsigned int idx, int label, const Point& vote)
+{
+	const float count = 1.0f / m_scale;
+
+	if(m_nodeIndex.empty())
+		m_nodeIndex.assign(1 << m_numTests, 0);
+
+	if(m_nodeIndex[idx] == 0)
 	{
 		// insert new node
-		Node newnode(MAP_SIZE, MAP_STEP);
-		it = m_nodeTable.insert ( make_pair( idx, newnode) ).first;
+		m_nodes.push_back( Node(count) );
+		m_nodeIndex[idx] = m_nodes.size();
 	}
 
-	Node& node = (*it).second;
-	Point vote = Point(center.x-pos.x, center.y-pos.y);
+	Node& node = m_nodes[m_nodeIndex[idx] - 1];
 
 	// update node
 	if((label == GC_FGD) || (label == GC_PR_FGD))
 	{
-		node.updateMap( vote );
-		node.numPos += 1.0f;
+		node.updateMap( vote, count );
+		node.numPos += count;
 		numPos += 1.0f;
 	}
 	else if(label == GC_BGD)
 	{
-		node.numNeg += 1.0f;
+		node.numNeg += count;
 		numNeg += 1.0f;
 	}
 	else
@@ -177,6 +417,95 @@ void Fern::update(Features& ft, const Point& pos, int label, const Point& center
 	//float negRatio = node.numNeg / numNeg;
 	float negPosRatio = numNeg / numPos;
 	node.probPos = negPosRatio * node.numPos / (negPosRatio * node.numPos + node.numNeg);//posRatio / (negRatio + posRatio);
+	node.invalidate();
 
 //	node.probPos = static_cast<float>(node.numPos) / static_cast<float>(node.numPos + node.numNeg); // how to adjust number of samples?
-}
\ No newline at end of file
+}
+void Ferns::evaluate(const Features& ft, const Rect& ROI, Mat& result, int stepSize, float threshold, unsigned int numThreads)
+{
+	evaluate(ft, ROI, result, Point(0, 0), stepSize, threshold, numThreads);
+}
+
+void Ferns::evaluate(const Features& ft, const Rect& ROI, Mat& result, const Point& origin, int stepSize, float threshold, unsigned int numThreads)
+{
+	if(!isSorted)
+	{
+		std::sort(m_ferns.begin(), m_ferns.end(), sortFernsDesc);
+		isSorted = true;
+	}
+
+	const unsigned int numFerns = m_ferns.size()/2;
+	if(numThreads <= 1 || numFerns <= 1)
+	{
+		for(unsigned int f = 0; f < numFerns; f++)
+		{
+			m_ferns.at(f).evaluate(ft, ROI, result, origin, stepSize, 0.5f);
+		}
+	}
+	else
+	{
+		// every thread sums the votes of its ferns over the points votes can reach, then those are added in fern order
+		const int reach = static_cast<int>(MAP_SIZE * MAP_STEP / 2.0f) + 1;
+		const Rect votesRect = Rect(ROI.x - reach, ROI.y - reach, ROI.width + 2 * reach, ROI.height + 2 * reach) &
+							   Rect(origin.x, origin.y, result.cols, result.rows);
+		if(votesRect.width <= 0 || votesRect.height <= 0)
+			return;
+
+		for(unsigned int f = 0; f < numFerns; f++)
+			m_ferns[f].cacheVotes();
+
+		vector< FernJob > jobs = splitFerns(m_ferns, numFerns, numThreads, ft, ROI, stepSize);
+		for(unsigned int t = 0; t < jobs.size(); t++)
+		{
+			jobs[t].votesRect = votesRect;
+			jobs[t].votes = Mat(votesRect.height, votesRect.width, CV_32FC1, Scalar(0.0f));
+		}
+		runJobs(jobs, evaluateFerns);
+
+		Mat votes = result(votesRect - origin);
+		for(unsigned int t = 0; t < jobs.size(); t++)
+			votes += jobs[t].votes;
+	}
+
+	GaussianBlur(result, result, Size(5,5), 0);
+}
+
+int Ferns::backProject(const Features& ft, Mat& projected, const Rect& ROI, Point& center, float radius, int stepSize, float threshold, unsigned int numThreads)
+{
+	if(!isSorted)
+	{
+		std::sort(m_ferns.begin(), m_ferns.end(), sortFernsDesc);
+		isSorted = true;
+	}
+
+	int cnt = 0;
+	const unsigned int numFerns = m_ferns.size()/2;
+	if(numThreads <= 1 || numFerns <= 1)
+	{
+		for(unsigned int f = 0; f < numFerns; f++)
+		{
+			cnt += m_ferns.at(f).backProject(ft, projected, ROI, center, radius, stepSize);
+		}
+		return cnt;
+	}
+
+	// a fern skips the points marked by the ferns before it, so the votes are counted in parallel
+	// and marked in fern order
+	for(unsigned int f = 0; f < numFerns; f++)
+		m_ferns[f].cacheVotes();
+
+	vector< vector<unsigned char> > counts(numFerns);
+	vector< FernJob > jobs = splitFerns(m_ferns, numFerns, numThreads, ft, ROI, stepSize);
+	for(unsigned int t = 0; t < jobs.size(); t++)
+	{
+		jobs[t].projected = &projected;
+		jobs[t].center = center;
+		jobs[t].radius = radius;
+		jobs[t].counts = &counts;
+	}
+	runJobs(jobs, countFerns);
+
+	for(unsigned int f = 0; f < numFerns; f++)
+		cnt += markCounts(projected, ROI, stepSize, counts[f]);
+	return cnt;
+}
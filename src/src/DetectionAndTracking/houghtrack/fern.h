@@ -6,6 +6,7 @@
 #ifndef FERN_H_
 #define FERN_H_
 
+#include <algorithm>
 #include <vector>
 #include <deque>
 #include <math.h>
@@ -17,27 +18,59 @@
 
 #define MAP_SIZE 100.0f
 #define MAP_STEP 2.0f
+// the scale of a fern's votes below which they are brought back to a scale of 1
+#define MIN_VOTE_SCALE 1e-6f
 
 bool sortVotesDesc (const std::pair<CvPoint, float>& A, const std::pair<CvPoint, float>& B);
 
+// a RandomTest resolved against the channels of one Features
+struct CompiledTest
+{
+	const uchar* channel; // the first pixel of the channel
+	int step;             // bytes per channel row
+	int offA, offB;       // the pixels compared for the patch centered on frame point (0,0), from channel
+};
+
 class RandomTest
 {
 public:
-	RandomTest(const cv::Size& baseSize, unsigned int numChannels)
+	RandomTest(const cv::Size& baseSize, unsigned int numChannels, unsigned int& seed)
 	{
-		channel = static_cast<unsigned int>(randIntFromRange(0,numChannels));
-		A = cv::Point(randIntFromRange(0,baseSize.width), randIntFromRange(0,baseSize.height));
-		B = cv::Point(randIntFromRange(0,baseSize.width), randIntFromRange(0,baseSize.height));
+		channel = static_cast<unsigned int>(randIntFromRange(0,numChannels,seed));
+		A = cv::Point(randIntFromRange(0,baseSize.width,seed), randIntFromRange(0,baseSize.height,seed));
+		B = cv::Point(randIntFromRange(0,baseSize.width,seed), randIntFromRange(0,baseSize.height,seed));
 	}
 
-	inline bool eval( const Features& ft, const cv::Point& base) const
+	RandomTest(std::istream& is)
 	{
-		cv::Mat img = ft.getChannel(channel);
-		IplImage ch = img;
+		read(is);
+	}
 
-		int valA = static_cast<int>(CV_IMAGE_ELEM(&ch, unsigned char, base.y + A.y, base.x + A.x));
-		int valB = static_cast<int>(CV_IMAGE_ELEM(&ch, unsigned char, base.y + B.y, base.x + B.x));
-		return (valA > valB);
+	inline void write(std::ostream& os) const
+	{
+		os.write((const char *) &channel, sizeof(channel));
+		os.write((const char *) &A, sizeof(A));
+		os.write((const char *) &B, sizeof(B));
+	}
+
+	inline void read(std::istream& is)
+	{
+		is.read((char *) &channel, sizeof(channel));
+		is.read((char *) &A, sizeof(A));
+		is.read((char *) &B, sizeof(B));
+	}
+
+	// the test for ft, whose channels start at frame point origin, of patches of baseSize
+	inline CompiledTest compile( const Features& ft, const cv::Size& baseSize ) const
+	{
+		const cv::Mat& img = ft.getChannel(channel);
+		const cv::Point base = cv::Point(baseSize.width/2, baseSize.height/2) + ft.getOrigin();
+		CompiledTest ct;
+		ct.channel = img.data;
+		ct.step = static_cast<int>(img.step[0]);
+		ct.offA = (A.y - base.y) * ct.step + A.x - base.x;
+		ct.offB = (B.y - base.y) * ct.step + B.x - base.x;
+		return ct;
 	};
 
 private:
@@ -47,57 +80,78 @@ private:
  
 class VoteTooLargeException: public std::exception {};
 
+// the leaf of a fern; the votes and counts are kept in the units of the fern they belong to, see Fern::forget()
 class Node
 {
 public:
-	Node(int size, int step) : numPos(1.0f), numNeg(1.0f), probPos(0.5f)
-	{
-		MapSize = size;
-		MapStep = step;
-		voteMap = cv::Mat( MapSize, MapSize, CV_32FC1, cv::Scalar(0.0f) );
-	};
+	static const int MapSize = (int) MAP_SIZE;
+	static const int MapStep = (int) MAP_STEP;
+
+	static const int MaxVotes = 10;
 
-	~Node()
+	// a cell of the MapSize x MapSize vote map, x * MapSize + y, and its number of votes
+	typedef std::pair<unsigned short, float> Vote;
+
+	// the strongest votes of the node, strongest first, as offsets from the patch and their weights
+	struct VoteList
 	{
-		voteMap.release();
-		buffered.clear();
+		int size;
+		cv::Point offset[MaxVotes];
+		float weight[MaxVotes];
 	};
 
-	Node(const Node& n) : numPos(n.numPos), numNeg(n.numNeg), probPos(n.probPos)
+	explicit Node(float count = 1.0f) : numPos(count), numNeg(count), probPos(0.5f), m_cached(false)
 	{
-		voteMap = n.voteMap;
-		MapSize = n.MapSize;
-		MapStep = n.MapStep;
 	};
 
- 
 	float numPos, numNeg;
 	float probPos;
 
-	int MapStep;
-	int MapSize;
-	cv::Mat voteMap;
-	mutable std::vector< std::pair<cv::Point, float> > buffered;
+	// only the cells voted for, in increasing order
+	std::vector< Vote > votes;
+
+	inline void write(std::ostream& os) const
+	{
+		os.write((const char *) &numPos, sizeof(numPos));
+		os.write((const char *) &numNeg, sizeof(numNeg));
+		os.write((const char *) &probPos, sizeof(probPos));
+		unsigned int numVotes = votes.size();
+		os.write((const char *) &numVotes, sizeof(numVotes));
+		if(numVotes > 0)
+			os.write((const char *) &votes[0], numVotes * sizeof(Vote));
+	}
+
+	inline void read(std::istream& is)
+	{
+		is.read((char *) &numPos, sizeof(numPos));
+		is.read((char *) &numNeg, sizeof(numNeg));
+		is.read((char *) &probPos, sizeof(probPos));
+		unsigned int numVotes = 0;
+		is.read((char *) &numVotes, sizeof(numVotes));
+		votes.resize(numVotes);
+		if(numVotes > 0)
+			is.read((char *) &votes[0], numVotes * sizeof(Vote));
+		invalidate();
+	}
 
-	inline void forget( const double& factor )
+	inline void rescale( const float& factor )
 	{
-		voteMap *= factor;
+		for(unsigned int v = 0; v < votes.size(); v++)
+			votes[v].second *= factor;
 		numPos *= factor;
 		numNeg *= factor;
+		invalidate();
 	}
 
-	inline void clear()
+	// the cached votes have to be rebuilt after the votes, numPos or probPos changed
+	inline void invalidate()
 	{
-		voteMap = 0.0f;
-		numPos = 1.0f;
-		numNeg = 1.0f;
-		probPos = 0.5f;
-		buffered.clear();
+		m_cached = false;
 	}
 
-	inline void updateMap( const cv::Point& vote )
+	inline void updateMap( const cv::Point& vote, const float& count )
 	{
-		buffered.clear();
+		invalidate();
 		int idx = round(static_cast<float>(vote.x) / (float)MapStep) + (float)MapSize/2.0f;
 		int idy = round(static_cast<float>(vote.y) / (float)MapStep) + (float)MapSize/2.0f;
 
@@ -106,52 +160,88 @@ public:
 			throw VoteTooLargeException();
 		}
 		else {
-			voteMap.at<float>(idy, idx) += 1.0f;
+			const Vote cell(static_cast<unsigned short>(idx * MapSize + idy), 0.0f);
+			std::vector< Vote >::iterator it = std::lower_bound(votes.begin(), votes.end(), cell, voteCellLess);
+			if(it == votes.end() || it->first != cell.first)
+				it = votes.insert(it, cell);
+			it->second += count;
 		}
 	}
 
-	inline std::vector< std::pair<cv::Point, float> > getVotes() const
+	// the MaxVotes strongest cells above the mean; built on the first call after the node changed, so
+	// threads evaluating the node at the same time need it built before, see Fern::cacheVotes()
+	inline const VoteList& getVotes() const
+	{
+		if(!m_cached)
+			cacheVotes();
+		return m_votes;
+	}
+
+	// the memory held by the node besides the node itself
+	inline size_t getBytes() const
 	{
-		//if(buffered.size() > 0)
-		//	return buffered;
+		return votes.capacity() * sizeof(Vote);
+	}
 
+private:
+	mutable VoteList m_votes;
+	mutable bool m_cached;
+
+	inline void cacheVotes() const
+	{
 		std::vector< std::pair<cv::Point, float> > ret;
 		float avg = static_cast<float>(numPos)/(MapSize*MapSize);
 
-		for(int x = 0; x < MapSize; x++)
+		// the cells in the order of the x, y scan over the dense map
+		for(unsigned int v = 0; v < votes.size(); v++)
 		{
-			for(int y = 0; y < MapSize; y++)
+			float val = votes[v].second;
+			if(val > avg)
 			{
-				float val = voteMap.at<float>(y, x);
-				if(val > avg)
-				{
-					int voteX = static_cast<int>(round((x - MapSize/2.0f) * MapStep));
-					int voteY = static_cast<int>(round((y - MapSize/2.0f) * MapStep));
-
-					ret.push_back( std::make_pair( cv::Point(voteX, voteY), probPos * val / numPos ));
-				}
+				int x = votes[v].first / MapSize;
+				int y = votes[v].first % MapSize;
+				int voteX = static_cast<int>(round((x - MapSize/2.0f) * MapStep));
+				int voteY = static_cast<int>(round((y - MapSize/2.0f) * MapStep));
+
+				ret.push_back( std::make_pair( cv::Point(voteX, voteY), probPos * val / numPos ));
 			}
 		}
 
 		std::sort(ret.begin(), ret.end(), sortVotesDesc);
-		ret.resize( std::min(10, (int)ret.size()) );
-		//buffered = ret;
+		m_votes.size = std::min(MaxVotes, (int)ret.size());
+		for(int v = 0; v < m_votes.size; v++)
+		{
+			m_votes.offset[v] = ret[v].first;
+			m_votes.weight[v] = ret[v].second;
+		}
+		m_cached = true;
+	}
 
-		return ret;
+	static inline bool voteCellLess(const Vote& a, const Vote& b)
+	{
+		return a.first < b.first;
 	}
 };
 
 class Fern
 {
 public:
-	Fern( const cv::Size& baseSize, unsigned int numTests, unsigned int numChannels );
+	Fern( const cv::Size& baseSize, unsigned int numTests, unsigned int numChannels, unsigned int& seed );
 	~Fern();
 
-	void evaluate(Features& ft, const cv::Rect& ROI, cv::Mat& result, int stepSize = 1, float threshold = 0.5f) const;
-	void update(Features& ft, const cv::Point& pos, int label, const cv::Point& center);
+	void evaluate(const Features& ft, const cv::Rect& ROI, cv::Mat& result, int stepSize = 1, float threshold = 0.5f) const;
+	// as above with result holding the votes of the frame points from origin on
+	void evaluate(const Features& ft, const cv::Rect& ROI, cv::Mat& result, const cv::Point& origin, int stepSize, float threshold) const;
+	void update(const Features& ft, const cv::Point& pos, int label, const cv::Point& center);
+	// learns the points in order, as if update() was called for each
+	void update(const Features& ft, const std::vector< std::pair<cv::Point, int> >& samples, const cv::Point& center);
 	void forget(const double& factor);
 	void clear();
-	int backProject(Features& ft, cv::Mat& projected, const cv::Rect& ROI, cv::Point& center, float radius, int stepSize = 1, float threshold = 0.5f) const;
+	int backProject(const Features& ft, cv::Mat& projected, const cv::Rect& ROI, cv::Point& center, float radius, int stepSize = 1, float threshold = 0.5f) const;
+	// the votes within radius of center of the ROI points at stepSize intervals, row by row; 0 for points that are GC_FGD in projected
+	void backProjectCounts(const Features& ft, const cv::Mat& projected, const cv::Rect& ROI, const cv::Point& center, float radius, int stepSize, float threshold, std::vector<unsigned char>& counts) const;
+	void write(std::ostream& os) const;
+	void read(std::istream& is);
 
 	cv::Size getBaseSize() const
 	{
@@ -160,17 +250,26 @@ public:
 
 	int getTableSize() const
 	{
-		return m_nodeTable.size();
+		return m_nodes.size();
+	}
+
+	// the memory held by the fern besides the fern itself
+	size_t getBytes() const;
+
+	// builds the vote lists of the nodes that changed, so that several threads can evaluate the fern
+	void cacheVotes() const
+	{
+		for(unsigned int n = 0; n < m_nodes.size(); n++)
+			m_nodes[n].getVotes();
 	}
 
 	void printStatistics() const
 	{
-		std::cout << "{ " << m_nodeTable.size() << " / " << std::pow(2, m_numTests) << " } " << std::endl;;
+		std::cout << "{ " << m_nodes.size() << " / " << std::pow(2, m_numTests) << " } " << std::endl;;
 
-		std::map< unsigned int, Node >::const_iterator it = m_nodeTable.begin();
-		while(it != m_nodeTable.end())
+		for(unsigned int n = 0; n < m_nodes.size(); n++)
 		{
-			std::cout << "  " << (*it++).second.probPos;
+			std::cout << "  " << m_nodes[n].probPos;
 		}
 		std::cout << std::endl;
     };
@@ -178,23 +277,46 @@ public:
 
 private:
 	std::vector< RandomTest > m_tests;
-	std::map< unsigned int, Node > m_nodeTable;
+	// the node of each index plus one, 0 if none; allocated with the first node, so numTests is at most 15
+	std::vector< unsigned short > m_nodeIndex;
+	std::vector< Node > m_nodes;
 	cv::Size m_baseSize;
 	unsigned int m_numTests;
 	float numPos, numNeg;
+	// forget() scales this instead of every vote; a vote counts 1/m_scale in the node units
+	float m_scale;
+
+	inline const Node* findNode(unsigned int idx) const
+	{
+		if(m_nodeIndex.empty() || m_nodeIndex[idx] == 0)
+			return NULL;
+		return &m_nodes[m_nodeIndex[idx] - 1];
+	}
+
+	inline void compile(const Features& ft, std::vector<CompiledTest>& tests) const
+	{
+		tests.resize(m_tests.size());
+		for(unsigned int t = 0; t < m_tests.size(); t++)
+			tests[t] = m_tests[t].compile(ft, m_baseSize);
+	};
 
-	inline unsigned int calcIndex(Features& ft, const cv::Point& point) const
+	inline unsigned int calcIndex(const std::vector<CompiledTest>& tests, const cv::Point& point) const
 	{
 		unsigned int idx = 0x00000000;
 		for(unsigned int t = 0; t < m_numTests; t++)
 		{
-			idx = idx << 1;
-			idx &= 0xFFFFFFFE;
-			if( m_tests.at(t).eval( ft, cv::Point( point.x - m_baseSize.width/2, point.y - m_baseSize.height/2)) )
-				idx |= 0x00000001;
+			const CompiledTest& test = tests[t];
+			const int pixel = point.y * test.step + point.x;
+			idx = (idx << 1) | (test.channel[pixel + test.offA] > test.channel[pixel + test.offB] ? 1 : 0);
 		}
 		return idx;
 	};
+
+	// the indices of the ROI points at stepSize intervals, row by row
+	void calcIndices(const std::vector<CompiledTest>& tests, const cv::Rect& ROI, int stepSize, std::vector<unsigned short>& idx) const;
+
+	// learns the patch of index idx with its vote
+	void learn(unsigned int idx, int label, const cv::Point& vote);
 };
 
 bool sortFernsDesc (const Fern& A, const Fern& B);
@@ -212,61 +334,43 @@ public:
 		m_ferns.clear();
 	};
 
-	void initialize(unsigned int numFerns, const cv::Size& baseSize, unsigned int numTests, unsigned int numChannels)
+	// the random tests are drawn from seed so the same seed always gives the same ferns
+	void initialize(unsigned int numFerns, const cv::Size& baseSize, unsigned int numTests, unsigned int numChannels, unsigned int seed)
 	{
 		clear();
 		m_ferns.clear();
 		std::cout << " INIT FERNS (" << numFerns << ", " << baseSize.width << "/" << baseSize.height << ", " << numTests << ", " << numChannels << ")" << std::endl;
     		for(unsigned int f = 0; f < numFerns; f++)
     		{
-    			m_ferns.push_back( Fern(baseSize, numTests, numChannels) );
+    			m_ferns.push_back( Fern(baseSize, numTests, numChannels, seed) );
     		}
   		isSorted = false;
 	}
 
-	void evaluate(Features& ft, const cv::Rect& ROI, cv::Mat& result, int stepSize = 1, float threshold = 0.5f)
-	{
-		if(!isSorted)
-		{
-			std::sort(m_ferns.begin(), m_ferns.end(), sortFernsDesc);
-			isSorted = true;
-		}
+	// the ferns are split over numThreads threads, each summing its votes separately
+	void evaluate(const Features& ft, const cv::Rect& ROI, cv::Mat& result, int stepSize = 1, float threshold = 0.5f, unsigned int numThreads = 1);
 
-		// attention shared memory!
-		for(unsigned int f = 0; f < m_ferns.size()/2; f++)
-		{
-			std::cout.flush();
-	        m_ferns.at(f).evaluate(ft, ROI, result, stepSize);
-	    }
+	// as above with result(0,0) at origin, for summing the votes of a part of the frame only
+	void evaluate(const Features& ft, const cv::Rect& ROI, cv::Mat& result, const cv::Point& origin, int stepSize, float threshold, unsigned int numThreads);
 
-		GaussianBlur(result, result, cv::Size(5,5), 0);
-	};
+	// the ferns are split over numThreads threads; the result is the same as with one
+	int backProject(const Features& ft, cv::Mat& projected, const cv::Rect& ROI, cv::Point& center, float radius, int stepSize = 1, float threshold = 0.5f, unsigned int numThreads = 1);
 
-	int backProject(Features& ft, cv::Mat& projected, const cv::Rect& ROI, cv::Point& center, float radius, int stepSize = 1, float threshold = 0.5f)
+	void update(const Features& ft, const cv::Point& pos, int label, const cv::Point& center)
 	{
-		if(!isSorted)
-		{
-			std::sort(m_ferns.begin(), m_ferns.end(), sortFernsDesc);
-			isSorted = true;
-		}
-
-		int cnt = 0;
-
-		// attention shared memory!
-		for(unsigned int f = 0; f < m_ferns.size()/2; f++)
+		for(unsigned int f = 0; f < m_ferns.size(); f++)
 		{
-			std::cout.flush();
-	        cnt += m_ferns.at(f).backProject(ft, projected, ROI, center, radius, stepSize);
-	    }
-
-		return cnt;
-	}
+			m_ferns.at(f).update(ft, pos, label, center);
+    	}
+		isSorted = false;
+    };
 
-	void update(Features& ft, const cv::Point& pos, int label, const cv::Point& center)
+	// learns the points in order, as if update() was called for each
+	void update(const Features& ft, const std::vector< std::pair<cv::Point, int> >& samples, const cv::Point& center)
 	{
 		for(unsigned int f = 0; f < m_ferns.size(); f++)
 		{
-			m_ferns.at(f).update(ft, pos, label, center);
+			m_ferns.at(f).update(ft, samples, center);
     	}
 		isSorted = false;
     };
@@ -292,6 +396,38 @@ public:
         return m_ferns.at(0).getBaseSize();
     };
 
+	void write(std::ostream& os) const
+	{
+		unsigned int numFerns = m_ferns.size();
+		os.write((const char *) &numFerns, sizeof(numFerns));
+		os.write((const char *) &isSorted, sizeof(isSorted));
+		for(unsigned int f = 0; f < numFerns; f++)
+			m_ferns.at(f).write(os);
+	};
+
+	void read(std::istream& is)
+	{
+		unsigned int numFerns = 0;
+		is.read((char *) &numFerns, sizeof(numFerns));
+		is.read((char *) &isSorted, sizeof(isSorted));
+		m_ferns.clear();
+		unsigned int seed = 0;
+		for(unsigned int f = 0; f < numFerns; f++)
+		{
+			m_ferns.push_back( Fern(cv::Size(), 0, 0, seed) );
+			m_ferns.back().read(is);
+		}
+	};
+
+	// the memory held by the ferns
+	size_t getBytes() const
+	{
+		size_t bytes = m_ferns.capacity() * sizeof(Fern);
+		for(unsigned int f = 0; f < m_ferns.size(); f++)
+			bytes += m_ferns[f].getBytes();
+		return bytes;
+	}
+
 	void printStatistics()
 	{
 		if(!isSorted)
@@ -46,6 +46,10 @@ int randIntFromRange(const int from, const int range) {
     return from + int(range*randDouble());
 }
 
+int randIntFromRange(const int from, const int range, unsigned int& seed) {
+    return from + int(range*(rand_r(&seed)/(RAND_MAX + 1.0)));
+}
+
 // adapted from GNU Scientific Library
 double randGauss( double std_dev )
 {
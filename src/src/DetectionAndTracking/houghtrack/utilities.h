@@ -36,6 +36,9 @@ double randGauss( double std_dev );
 //! Returns an integer in [from:from + range]
 int randIntFromRange(const int from, const int range);
 
+//! Returns an integer in [from:from + range] drawn from the generator state seed rather than the global one
+int randIntFromRange(const int from, const int range, unsigned int& seed);
+
 std::string createFilename(std::string prefix, int idx, std::string suffix, int numLength = 4);
 
 void setCenter(cv::Rect& rect, const cv::Point& center);
@@ -25,19 +25,20 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
 #include "filter.h"
 #include "segment-graph.h"
 
-// random color
-rgb random_rgb(){ 
+// random color drawn from the generator state seed, so that segmenting
+// the same image always gives the same colors whatever runs alongside
+rgb random_rgb(unsigned int *seed){ 
   rgb c;
 
-  c.r = random();
-  c.g = random();
-  c.b = random();
+  c.r = rand_r(seed);
+  c.g = rand_r(seed);
+  c.b = rand_r(seed);
 
   // exclude black since that's the mask color used in the image provided by --mbari-mask-path, e.g.
   while (c.r == 0 && c.g == 0 && c.b == 0) {
-      c.r = random();
-      c.g = random();
-      c.b = random();
+      c.r = rand_r(seed);
+      c.g = rand_r(seed);
+      c.b = rand_r(seed);
   }
 
   return c;
@@ -140,8 +141,9 @@ image<rgb> *segment_image(image<rgb> *im, float sigma, float c, int min_size, fl
 
   // pick random colors for each component
   rgb *colors = new rgb[width*height];
+  unsigned int seed = 1;
   for (int i = 0; i < width*height; i++)
-    colors[i] = random_rgb();
+    colors[i] = random_rgb(&seed);
 
   bool found;
   rgb seedColor;